@@ -1,11 +1,443 @@
+#define _GNU_SOURCE
 #include "file_reader.h"
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
+static void fat_entry_name(const struct fat_entry_t* entry, char* name){
+    int i=0;
+    int j=0;
 
-struct disk_t* disk_open_from_file(const char* volume_file_name){
-    if(volume_file_name == NULL){
+    while(i<8 && entry->name[i] != ' '){
+        name[i] = (char)entry->name[i];
+        i++;
+    }
+    // 0x05 stands in for a leading 0xE5, which would otherwise mark a deleted entry
+    if(entry->name[0] == 0x05){
+        name[0] = (char)0xE5;
+    }
+    if(entry->extension[0] != ' '){
+        name[i] = '.';
+        i++;
+        while(j<3 && entry->extension[j] != ' '){
+            name[i] = (char)entry->extension[j];
+            j++;
+            i++;
+        }
+    }
+    name[i] = '\0';
+}
+
+static void lfn_reset(struct lfn_state_t* lfn){
+    lfn->valid = 0;
+    lfn->slots = 0;
+    lfn->next = 0;
+}
+
+// Collects one LFN slot. Slots must arrive in descending order starting with
+// the one flagged 0x40 and all carry the same checksum, otherwise the run is dropped.
+static void lfn_feed(struct lfn_state_t* lfn, const struct fat_lfn_entry_t* slot){
+    uint8_t seq = slot->order & 0x1F;
+    if(slot->order & 0x40){
+        lfn->valid = 1;
+        lfn->slots = seq;
+        lfn->next = seq;
+        lfn->checksum = slot->checksum;
+    }
+    if(!lfn->valid || seq == 0 || seq > 20 || seq != lfn->next || slot->checksum != lfn->checksum){
+        lfn_reset(lfn);
+        return;
+    }
+    uint16_t *units = lfn->units + (seq - 1) * 13;
+    memcpy(units, slot->name1, sizeof(slot->name1));
+    memcpy(units + 5, slot->name2, sizeof(slot->name2));
+    memcpy(units + 11, slot->name3, sizeof(slot->name3));
+    lfn->next--;
+}
+
+static uint8_t lfn_checksum(const struct fat_entry_t* entry){
+    uint8_t sum = 0;
+    for(int i = 0; i < 8; i++){
+        sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + entry->name[i]);
+    }
+    for(int i = 0; i < 3; i++){
+        sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + entry->extension[i]);
+    }
+    return sum;
+}
+
+// Completes the run collected for the 8.3 entry that follows it and writes the
+// name as UTF-8. Returns 1 when long_name was filled, 0 when there is no valid LFN.
+// Names VFAT would never write (control or reserved characters, "." and "..")
+// count as invalid so the entry is reached through its 8.3 name instead.
+static int lfn_finish(struct lfn_state_t* lfn, const struct fat_entry_t* entry, char* long_name){
+    int complete = lfn->valid && lfn->slots > 0 && lfn->next == 0 && lfn->checksum == lfn_checksum(entry);
+    uint32_t count = lfn->slots * 13;
+    lfn_reset(lfn);
+    if(!complete){
+        return 0;
+    }
+
+    uint32_t out = 0;
+    for(uint32_t i = 0; i < count && lfn->units[i] != 0x0000 && lfn->units[i] != 0xFFFF; i++){
+        uint32_t cp = lfn->units[i];
+        if(cp < 0x20 || (cp < 0x80 && strchr("\"*/:<>?\\|", (int)cp) != NULL)){
+            return 0;
+        }
+        if(cp >= 0xD800 && cp <= 0xDBFF && i + 1 < count && lfn->units[i+1] >= 0xDC00 && lfn->units[i+1] <= 0xDFFF){
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (lfn->units[i+1] - 0xDC00);
+            i++;
+        }
+        else if(cp >= 0xD800 && cp <= 0xDFFF){
+            cp = 0xFFFD;
+        }
+        uint32_t len = cp < 0x80 ? 1 : cp < 0x800 ? 2 : cp < 0x10000 ? 3 : 4;
+        if(out + len + 1 > FAT_LONG_NAME_MAX){
+            break;
+        }
+        if(cp < 0x80){
+            long_name[out++] = (char)cp;
+        }
+        else if(cp < 0x800){
+            long_name[out++] = (char)(0xC0 | (cp >> 6));
+            long_name[out++] = (char)(0x80 | (cp & 0x3F));
+        }
+        else if(cp < 0x10000){
+            long_name[out++] = (char)(0xE0 | (cp >> 12));
+            long_name[out++] = (char)(0x80 | ((cp >> 6) & 0x3F));
+            long_name[out++] = (char)(0x80 | (cp & 0x3F));
+        }
+        else{
+            long_name[out++] = (char)(0xF0 | (cp >> 18));
+            long_name[out++] = (char)(0x80 | ((cp >> 12) & 0x3F));
+            long_name[out++] = (char)(0x80 | ((cp >> 6) & 0x3F));
+            long_name[out++] = (char)(0x80 | (cp & 0x3F));
+        }
+    }
+    long_name[out] = '\0';
+    if(strcmp(long_name, ".") == 0 || strcmp(long_name, "..") == 0){
+        return 0;
+    }
+    return out > 0;
+}
+
+
+static int load_dir_entries(struct volume_t* pvolume, uint16_t first_cluster, struct fat_entry_t** pentries, uint32_t* pcount);
+static struct fat_entry_t* dir_next_entry(struct fat_entry_t* entries, uint32_t count, uint32_t* pos,
+        struct lfn_state_t* lfn, char* long_name, int* has_long_name);
+
+// Lookup index used by file_open. A directory is indexed the first time a lookup
+// goes through it: it is read once and each entry is hashed under its (parent,
+// name) pair, for the 8.3 name and for the long name. A directory that cannot be
+// read keeps its errno, so neither outcome leads to a second scan, and a damaged
+// subdirectory only affects paths below it.
+#define NAME_INDEX_NONE UINT32_MAX
+#define NAME_DIR_UNLOADED (-1)
+
+struct name_node_t {
+    uint32_t hash;
+    uint32_t parent;
+    uint32_t entry;
+    uint32_t name;      // offset into the name pool
+    uint32_t next;
+};
+
+struct name_index_t {
+    struct fat_entry_t *entries;
+    int *dir_states;                // per entry: NAME_DIR_UNLOADED, 0 once indexed, or errno
+    uint32_t entry_count;
+    uint32_t entry_capacity;
+    int root_state;
+    struct name_node_t *nodes;
+    uint32_t node_count;
+    uint32_t node_capacity;
+    char *names;
+    uint32_t names_size;
+    uint32_t names_capacity;
+    uint32_t *buckets;
+    uint32_t bucket_count;
+};
+
+static char ascii_lower(char c){
+    return (c >= 'A' && c <= 'Z') ? (char)(c - 'A' + 'a') : c;
+}
+
+// FNV-1a over the ASCII-folded name, seeded with the parent id
+static uint32_t name_hash(uint32_t parent, const char* name, size_t len){
+    uint32_t hash = (2166136261u ^ parent) * 16777619u;
+    for(size_t i = 0; i < len; i++){
+        hash ^= (uint8_t)ascii_lower(name[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int name_equal(const char* a, const char* b, size_t len){
+    for(size_t i = 0; i < len; i++){
+        if(ascii_lower(a[i]) != ascii_lower(b[i])){
+            return 0;
+        }
+    }
+    return b[len] == '\0';
+}
+
+// Relinks the first node_count nodes into bucket_count buckets
+static int name_index_rehash(struct name_index_t* index, uint32_t bucket_count){
+    if(bucket_count != index->bucket_count){
+        uint32_t *buckets = realloc(index->buckets, bucket_count * sizeof(uint32_t));
+        if(buckets == NULL){
+            return -1;
+        }
+        index->buckets = buckets;
+        index->bucket_count = bucket_count;
+    }
+    memset(index->buckets, 0xFF, bucket_count * sizeof(uint32_t));
+    for(uint32_t i = 0; i < index->node_count; i++){
+        uint32_t bucket = index->nodes[i].hash & (bucket_count - 1);
+        index->nodes[i].next = index->buckets[bucket];
+        index->buckets[bucket] = i;
+    }
+    return 0;
+}
+
+static int name_index_add(struct name_index_t* index, uint32_t parent, uint32_t entry, const char* name){
+    size_t len = strlen(name);
+    if(index->node_count == index->node_capacity){
+        uint32_t capacity = index->node_capacity ? index->node_capacity * 2 : 256;
+        void *p = realloc(index->nodes, capacity * sizeof(struct name_node_t));
+        if(p == NULL) return -1;
+        index->nodes = p;
+        index->node_capacity = capacity;
+    }
+    while(index->names_size + len + 1 > index->names_capacity){
+        uint32_t capacity = index->names_capacity ? index->names_capacity * 2 : 4096;
+        void *p = realloc(index->names, capacity);
+        if(p == NULL) return -1;
+        index->names = p;
+        index->names_capacity = capacity;
+    }
+    // keeps the load factor at or below one half
+    if((index->node_count + 1) * 2 > index->bucket_count &&
+            name_index_rehash(index, index->bucket_count ? index->bucket_count * 2 : 64) != 0){
+        return -1;
+    }
+    uint32_t id = index->node_count++;
+    struct name_node_t* node = index->nodes + id;
+    node->hash = name_hash(parent, name, len);
+    node->parent = parent;
+    node->entry = entry;
+    node->name = index->names_size;
+    memcpy(index->names + index->names_size, name, len + 1);
+    index->names_size += len + 1;
+    uint32_t bucket = node->hash & (index->bucket_count - 1);
+    node->next = index->buckets[bucket];
+    index->buckets[bucket] = id;
+    return 0;
+}
+
+static int name_index_add_entry(struct name_index_t* index, uint32_t parent, const struct fat_entry_t* entry, const char* long_name){
+    if(index->entry_count == index->entry_capacity){
+        uint32_t capacity = index->entry_capacity ? index->entry_capacity * 2 : 256;
+        void *p = realloc(index->entries, capacity * sizeof(struct fat_entry_t));
+        if(p == NULL) return -1;
+        index->entries = p;
+        p = realloc(index->dir_states, capacity * sizeof(int));
+        if(p == NULL) return -1;
+        index->dir_states = p;
+        index->entry_capacity = capacity;
+    }
+    uint32_t id = index->entry_count++;
+    index->entries[id] = *entry;
+    index->dir_states[id] = NAME_DIR_UNLOADED;
+
+    char name[13];
+    fat_entry_name(entry, name);
+    if(name_index_add(index, parent, id, name) != 0){
+        return -1;
+    }
+    if(long_name != NULL && !name_equal(long_name, name, strlen(long_name))){
+        return name_index_add(index, parent, id, long_name);
+    }
+    return 0;
+}
+
+static struct name_index_t* name_index_create(void){
+    struct name_index_t* index = calloc(1, sizeof(struct name_index_t));
+    if(index == NULL){
+        errno = ENOMEM;
+        return NULL;
+    }
+    index->root_state = NAME_DIR_UNLOADED;
+    return index;
+}
+
+static void name_index_free(struct name_index_t* index){
+    if(index != NULL){
+        free(index->entries);
+        free(index->dir_states);
+        free(index->nodes);
+        free(index->names);
+        free(index->buckets);
+        free(index);
+    }
+}
+
+// Makes sure the directory parent (an entry id or DIR_ROOT_PARENT) is indexed
+static int name_index_load_dir(struct name_index_t* index, struct volume_t* pvolume, uint32_t parent){
+    int state = parent == DIR_ROOT_PARENT ? index->root_state : index->dir_states[parent];
+    if(state == NAME_DIR_UNLOADED){
+        uint16_t cluster = parent == DIR_ROOT_PARENT ? 0 : index->entries[parent].first_cluster_y;
+        struct fat_entry_t *entries;
+        uint32_t count;
+        state = 0;
+        if(parent != DIR_ROOT_PARENT && cluster < 2){
+            state = EINVAL;
+        }
+        else if(load_dir_entries(pvolume, cluster, &entries, &count) != 0){
+            if(errno == ENOMEM){
+                return -1;
+            }
+            state = errno;
+        }
+        else{
+            uint32_t entry_count = index->entry_count;
+            uint32_t node_count = index->node_count;
+            uint32_t names_size = index->names_size;
+            struct lfn_state_t lfn;
+            char long_name[FAT_LONG_NAME_MAX];
+            int has_long_name = 0;
+            uint32_t pos = 0;
+            struct fat_entry_t* entry;
+            lfn_reset(&lfn);
+            while((entry = dir_next_entry(entries, count, &pos, &lfn, long_name, &has_long_name)) != NULL){
+                if(name_index_add_entry(index, parent, entry, has_long_name ? long_name : NULL) != 0){
+                    // roll back the half-indexed directory so a later lookup can retry it
+                    index->entry_count = entry_count;
+                    index->node_count = node_count;
+                    index->names_size = names_size;
+                    name_index_rehash(index, index->bucket_count);
+                    free(entries);
+                    errno = ENOMEM;
+                    return -1;
+                }
+            }
+            free(entries);
+        }
+        if(parent == DIR_ROOT_PARENT){
+            index->root_state = state;
+        }
+        else{
+            index->dir_states[parent] = state;
+        }
+    }
+    if(state != 0){
+        errno = state;
+        return -1;
+    }
+    return 0;
+}
+
+static uint32_t name_index_find(const struct name_index_t* index, uint32_t parent, const char* name, size_t len){
+    if(index->bucket_count == 0){
+        return NAME_INDEX_NONE;
+    }
+    uint32_t hash = name_hash(parent, name, len);
+    for(uint32_t i = index->buckets[hash & (index->bucket_count - 1)]; i != NAME_INDEX_NONE; i = index->nodes[i].next){
+        const struct name_node_t* node = index->nodes + i;
+        if(node->hash == hash && node->parent == parent && name_equal(name, index->names + node->name, len)){
+            return node->entry;
+        }
+    }
+    return NAME_INDEX_NONE;
+}
+
+// Maps the data/hole extent around offset with SEEK_DATA/SEEK_HOLE. Files on
+// filesystems without hole support come back as a single data extent.
+static void segment_probe(struct disk_segment_t* seg, uint64_t offset){
+    seg->extent_start = offset;
+    seg->extent_end = seg->size;
+    seg->extent_is_hole = 0;
+#ifdef SEEK_DATA
+    off_t data = lseek(seg->fd, (off_t)offset, SEEK_DATA);
+    if(data < 0){
+        // ENXIO: nothing but a hole up to the end of the segment
+        seg->extent_is_hole = errno == ENXIO;
+        if(!seg->extent_is_hole){
+            seg->extent_start = 0;
+        }
+        return;
+    }
+    if((uint64_t)data > offset){
+        seg->extent_end = (uint64_t)data < seg->size ? (uint64_t)data : seg->size;
+        seg->extent_is_hole = 1;
+        return;
+    }
+    off_t hole = lseek(seg->fd, (off_t)offset, SEEK_HOLE);
+    if(hole > data && (uint64_t)hole < seg->size){
+        seg->extent_end = hole;
+    }
+#endif
+}
+
+// Reads within one segment; ranges inside a hole are zero-filled without touching the file
+static int segment_read(struct disk_segment_t* seg, uint64_t offset, uint8_t* buffer, size_t size){
+    while(size > 0){
+        if(offset < seg->extent_start || offset >= seg->extent_end){
+            segment_probe(seg, offset);
+        }
+        size_t chunk = size;
+        if(chunk > seg->extent_end - offset){
+            chunk = seg->extent_end - offset;
+        }
+        if(seg->extent_is_hole){
+            memset(buffer, 0, chunk);
+        }
+        else{
+            ssize_t res = pread(seg->fd, buffer, chunk, (off_t)offset);
+            if(res < 0 && errno == EINTR){
+                continue;
+            }
+            if(res <= 0){
+                errno = ERANGE;
+                return -1;
+            }
+            chunk = res;
+        }
+        buffer += chunk;
+        offset += chunk;
+        size -= chunk;
+    }
+    return 0;
+}
+
+// Binary search for the segment holding the byte at offset
+static struct disk_segment_t* disk_find_segment(struct disk_t* pdisk, uint64_t offset){
+    if(offset >= pdisk->size){
+        return NULL;
+    }
+    uint32_t low = 0;
+    uint32_t high = pdisk->segment_count;
+    while(high - low > 1){
+        uint32_t mid = low + (high - low) / 2;
+        if(pdisk->segments[mid].start <= offset){
+            low = mid;
+        }
+        else{
+            high = mid;
+        }
+    }
+    return pdisk->segments + low;
+}
+
+struct disk_t* disk_open_from_segments(const char* const* segment_names, uint32_t segment_count){
+    if(segment_names == NULL || segment_count == 0){
         errno = EFAULT;
         return NULL;
     }
@@ -14,16 +446,95 @@ struct disk_t* disk_open_from_file(const char* volume_file_name){
         errno = ENOMEM;
         return NULL;
     }
-    disk->file = fopen(volume_file_name,"rb");
-    if(disk->file==NULL){
+    disk->segments = calloc(segment_count, sizeof(struct disk_segment_t));
+    if(disk->segments == NULL){
         free(disk);
+        errno = ENOMEM;
+        return NULL;
+    }
+    disk->segment_count = 0;
+    disk->size = 0;
+
+    for(uint32_t i = 0; i < segment_count; i++){
+        if(segment_names[i] == NULL){
+            disk_close(disk);
+            errno = EFAULT;
+            return NULL;
+        }
+        int fd = open(segment_names[i], O_RDONLY);
+        struct stat st;
+        if(fd < 0 || fstat(fd, &st) != 0){
+            if(fd >= 0){
+                close(fd);
+            }
+            disk_close(disk);
+            errno = ENOENT;
+            return NULL;
+        }
+        // empty segments add nothing to the address space
+        if(st.st_size == 0){
+            close(fd);
+            continue;
+        }
+        struct disk_segment_t* seg = disk->segments + disk->segment_count++;
+        seg->fd = fd;
+        seg->start = disk->size;
+        seg->size = st.st_size;
+        seg->extent_start = 0;
+        seg->extent_end = 0;
+        seg->extent_is_hole = 0;
+        disk->size += seg->size;
+    }
+    return disk;
+}
+
+struct disk_t* disk_open_from_file(const char* volume_file_name){
+    if(volume_file_name == NULL){
+        errno = EFAULT;
+        return NULL;
+    }
+    size_t len = strlen(volume_file_name);
+    if(len <= 4 || strcmp(volume_file_name + len - 4, ".001") != 0){
+        return disk_open_from_segments(&volume_file_name, 1);
+    }
+
+    // split raw image: name.001, name.002, ... up to the first missing segment
+    char *name = malloc(len + 1);
+    if(name == NULL){
+        errno = ENOMEM;
+        return NULL;
+    }
+    memcpy(name, volume_file_name, len + 1);
+    uint32_t count = 0;
+    while(count < DISK_MAX_SEGMENTS){
+        snprintf(name + len - 3, 4, "%03u", count + 1);
+        if(access(name, F_OK) != 0){
+            break;
+        }
+        count++;
+    }
+    free(name);
+    if(count == 0){
         errno = ENOENT;
         return NULL;
     }
-    fseek(disk->file,0,SEEK_END);
-    disk->size = ftell(disk->file);
-    rewind(disk->file);
 
+    char *storage = malloc(count * (len + 1));
+    const char **names = malloc(count * sizeof(char*));
+    if(storage == NULL || names == NULL){
+        free(storage);
+        free(names);
+        errno = ENOMEM;
+        return NULL;
+    }
+    for(uint32_t i = 0; i < count; i++){
+        names[i] = storage + i * (len + 1);
+        memcpy(storage + i * (len + 1), volume_file_name, len - 3);
+        snprintf(storage + i * (len + 1) + len - 3, 4, "%03u", i + 1);
+    }
+    struct disk_t* disk = disk_open_from_segments(names, count);
+    free(storage);
+    free(names);
     return disk;
 }
 
@@ -32,25 +543,37 @@ int disk_read(struct disk_t* pdisk, int32_t first_sector, void* buffer, int32_t
         errno = EFAULT;
         return -1;
     }
-    if((first_sector+sectors_to_read)*SECTOR_SIZE > (int32_t)pdisk->size){
+    uint64_t offset = (uint64_t)first_sector * SECTOR_SIZE;
+    uint64_t size = (uint64_t)sectors_to_read * SECTOR_SIZE;
+    if(offset + size > pdisk->size){
         errno = ERANGE;
         return -1;
     }
 
-    fseek(pdisk->file,first_sector*SECTOR_SIZE,SEEK_SET);
-    int32_t res = fread(buffer,SECTOR_SIZE,sectors_to_read,pdisk->file);
-    if(res != sectors_to_read){
-        errno = ERANGE;
-        return -1;
+    // a read may span several segments
+    uint8_t *p = buffer;
+    while(size > 0){
+        struct disk_segment_t* seg = disk_find_segment(pdisk, offset);
+        uint64_t chunk = seg->start + seg->size - offset;
+        if(chunk > size){
+            chunk = size;
+        }
+        if(segment_read(seg, offset - seg->start, p, chunk) != 0){
+            return -1;
+        }
+        p += chunk;
+        offset += chunk;
+        size -= chunk;
     }
     return sectors_to_read;
 }
+
 int disk_close(struct disk_t* pdisk){
     if(pdisk!=NULL){
-        if(pdisk->file != NULL){
-            fclose(pdisk->file);
-            pdisk->file = NULL;
+        for(uint32_t i = 0; i < pdisk->segment_count; i++){
+            close(pdisk->segments[i].fd);
         }
+        free(pdisk->segments);
         free(pdisk);
         pdisk = NULL;
         return 0;
@@ -72,6 +595,7 @@ struct volume_t* fat_open(struct disk_t* pdisk, uint32_t first_sector){
     }
     vol->disk = pdisk;
     vol->first_sector = first_sector;
+    vol->name_index = NULL;
 
     if(disk_read(pdisk, (int32_t)first_sector, &vol->super_sector,1)!=1){
         free(vol);
@@ -164,6 +688,7 @@ int fat_close(struct volume_t* pvolume){
             free(pvolume->fat_table);
             pvolume->fat_table = NULL;
         }
+        name_index_free(pvolume->name_index);
         free(pvolume);
         pvolume = NULL;
         return 0;
@@ -181,73 +706,61 @@ struct file_t* file_open(struct volume_t* pvolume, const char* file_name){
         errno = EISDIR;
         return NULL;
     }
-
-    uint32_t root_size = pvolume->root_dir_sectors * SECTOR_SIZE;
-    uint8_t *root_buffer = malloc(root_size);
-    if (!root_buffer) {
-        errno = ENOMEM;
-        return NULL;
-    }
-    uint32_t root_start = pvolume->first_sector + pvolume->super_sector.reserved_sectors + pvolume->super_sector.fat_count * pvolume->super_sector.sectors_per_fat;
-
-    if (disk_read(pvolume->disk, (int32_t)root_start, root_buffer, pvolume->root_dir_sectors) != (int)pvolume->root_dir_sectors) {
-        free(root_buffer);
-        return NULL;
-    }
-
-    struct fat_entry_t *entries = (struct fat_entry_t*)root_buffer;
-    for (uint32_t i = 0; i < pvolume->super_sector.root_dir_capacity; i++) {
-        if (entries[i].name[0] == 0x00){
-            free(root_buffer);
+    if(pvolume->name_index == NULL){
+        pvolume->name_index = name_index_create();
+        if(pvolume->name_index == NULL){
             return NULL;
         }
-        if(entries[i].name[0] == 0xE5 ){
-            continue;
-        }
-        char entry_name[13];
-
-        int j=0;
-        int k=0;
+    }
+    struct name_index_t* index = pvolume->name_index;
 
-        while(j<8 && entries[i].name[j] != ' '){
-           entry_name[j] = (char)entries[i].name[j];
-            j++;
+    uint32_t id = NAME_INDEX_NONE;
+    uint32_t parent = DIR_ROOT_PARENT;
+    const char* component = file_name;
+    while(*component){
+        while(*component == '\\' || *component == '/'){
+            component++;
         }
-        if(entries[i].extension[0] != ' '){
-            entry_name[j] = '.';
-            j++;
-            while(k<3 && entries[i].extension[k] != ' '){
-                entry_name[j] = (char)entries[i].extension[k];
-                j++;
-                k++;
-            }
+        if(*component == '\0'){
+            break;
         }
-        entry_name[j] = '\0';
-        if(strcmp(entry_name, file_name) == 0){
-            if(entries[i].attr & 0x10 || entries[i].attr & 0x08){
-                errno = EISDIR;
-                free(root_buffer);
-                return NULL;
-            }
-            struct file_t* f = malloc(sizeof(struct file_t));
-            if(f == NULL){
-                errno = ENOMEM;
-                free(root_buffer);
+        const char* end = component;
+        while(*end && *end != '\\' && *end != '/'){
+            end++;
+        }
+        if(id != NAME_INDEX_NONE){
+            if(!(index->entries[id].attr & FAT_ATTR_DIRECTORY)){
+                errno = ENOTDIR;
                 return NULL;
             }
-            f->volume = pvolume;
-            f->entry = entries[i];
-            f->position = 0;
-            //walidacja i zwoleniania
-            f->chain = get_chain_fat16(pvolume->fat_table,pvolume->fat_size,f->entry.first_cluster_y);
-            free(root_buffer);
-            return f;
+            parent = id;
+        }
+        if(name_index_load_dir(index, pvolume, parent) != 0){
+            return NULL;
         }
+        id = name_index_find(index, parent, component, end - component);
+        if(id == NAME_INDEX_NONE){
+            errno = ENOENT;
+            return NULL;
+        }
+        component = end;
+    }
+    if(id == NAME_INDEX_NONE || index->entries[id].attr & (FAT_ATTR_DIRECTORY | FAT_ATTR_VOLUME)){
+        errno = EISDIR;
+        return NULL;
+    }
 
+    struct file_t* f = malloc(sizeof(struct file_t));
+    if(f == NULL){
+        errno = ENOMEM;
+        return NULL;
     }
-    free(root_buffer);
-    errno = ENOENT;
-    return NULL;
+    f->volume = pvolume;
+    f->entry = index->entries[id];
+    f->position = 0;
+    //walidacja i zwoleniania
+    f->chain = get_chain_fat16(pvolume->fat_table,pvolume->fat_size,f->entry.first_cluster_y);
+    return f;
 }
 
 
@@ -365,6 +878,7 @@ struct dir_t* dir_open(struct volume_t* pvolume, const char* dir_path){
     dir->current_entry = 0;
     dir->current_sector = pvolume->first_sector + pvolume->super_sector.reserved_sectors + (pvolume->super_sector.fat_count * pvolume->super_sector.sectors_per_fat);
     dir->max_entries = pvolume->super_sector.root_dir_capacity;
+    lfn_reset(&dir->lfn);
     return dir;
 }
 
@@ -374,8 +888,7 @@ int dir_read(struct dir_t* pdir, struct dir_entry_t* pentry){
         return -1;
     }
 
-    uint8_t sector_buffer[SECTOR_SIZE];
-    struct fat_entry_t* entries = (struct fat_entry_t*)sector_buffer;
+    struct fat_entry_t* entries = (struct fat_entry_t*)pdir->sector_buffer;
 
     while(pdir->current_entry < pdir->max_entries){
         uint32_t sector_index = pdir->current_entry / (SECTOR_SIZE / sizeof(struct fat_entry_t));
@@ -387,7 +900,7 @@ int dir_read(struct dir_t* pdir, struct dir_entry_t* pentry){
                 return -1;
             }
 
-            if(disk_read(pdir->volume->disk, pdir->current_sector + sector_index, sector_buffer, 1) !=1 ){
+            if(disk_read(pdir->volume->disk, pdir->current_sector + sector_index, pdir->sector_buffer, 1) !=1 ){
                 errno = EIO;
                 return -1;
             }
@@ -398,26 +911,21 @@ int dir_read(struct dir_t* pdir, struct dir_entry_t* pentry){
         if(*entry->name == 0x00){
             return 1;
         }
-        if(*entry->name == 0xE5 || entry->attr & 0x08 || entry->attr == 0x0F){
+        if(*entry->name == 0xE5){
+            lfn_reset(&pdir->lfn);
             continue;
         }
-        int i=0;
-        int j=0;
-
-        while(i<8 && entry->name[i] != ' '){
-            *(pentry->name+i) = (char)entry->name[i];
-            i++;
+        if(entry->attr == FAT_ATTR_LFN){
+            lfn_feed(&pdir->lfn, (const struct fat_lfn_entry_t*)entry);
+            continue;
         }
-        if(entry->extension[0] != ' '){
-            *(pentry->name+i) = '.';
-            i++;
-            while(j<3 && entry->extension[j] != ' '){
-                *(pentry->name+i) = (char)entry->extension[j];
-                j++;
-                i++;
-            }
+        if(!lfn_finish(&pdir->lfn, entry, pentry->long_name)){
+            pentry->long_name[0] = '\0';
         }
-        *(pentry->name+i) = '\0';
+        if(entry->attr & 0x08){
+            continue;
+        }
+        fat_entry_name(entry, pentry->name);
         pentry->size = entry->size;
         //atrybuty
         pentry->is_archived = 0;
@@ -445,6 +953,948 @@ int dir_close(struct dir_t* pdir){
     return -1;
 }
 
+// Reads a whole directory into memory: the fixed root area for first_cluster 0,
+// otherwise the cluster chain of a subdirectory.
+static int load_dir_entries(struct volume_t* pvolume, uint16_t first_cluster, struct fat_entry_t** pentries, uint32_t* pcount){
+    uint8_t *buffer;
+    uint32_t count;
+
+    if(first_cluster == 0){
+        *pentries = NULL;
+        *pcount = 0;
+        if(pvolume->root_dir_sectors == 0){
+            return 0;
+        }
+        buffer = malloc(pvolume->root_dir_sectors * SECTOR_SIZE);
+        if(buffer == NULL){
+            errno = ENOMEM;
+            return -1;
+        }
+        uint32_t root_start = pvolume->first_sector + pvolume->super_sector.reserved_sectors + pvolume->super_sector.fat_count * pvolume->super_sector.sectors_per_fat;
+        if(disk_read(pvolume->disk, (int32_t)root_start, buffer, pvolume->root_dir_sectors) != (int)pvolume->root_dir_sectors){
+            free(buffer);
+            errno = EIO;
+            return -1;
+        }
+        count = pvolume->super_sector.root_dir_capacity;
+    }
+    else{
+        // the chain comes from the image, so every step is bounds-checked and the
+        // walk gives up after total_clusters steps instead of following a loop forever
+        uint32_t clusters = 0;
+        uint16_t cluster = first_cluster;
+        while(cluster < FAT16_EOC_MIN){
+            if(cluster < 2 || cluster == FAT16_BAD_CLUSTER || (uint32_t)(cluster - 2) >= pvolume->total_clusters ||
+                    (uint32_t)cluster * 2 + 2 > pvolume->fat_size || clusters >= pvolume->total_clusters){
+                errno = EINVAL;
+                return -1;
+            }
+            clusters++;
+            cluster = *(uint16_t*)(pvolume->fat_table + cluster * 2);
+        }
+        uint32_t cluster_size = pvolume->super_sector.sectors_per_cluster * SECTOR_SIZE;
+        buffer = malloc(clusters * cluster_size);
+        if(buffer == NULL){
+            errno = ENOMEM;
+            return -1;
+        }
+        cluster = first_cluster;
+        for(uint32_t i = 0; i < clusters; i++){
+            uint32_t sector = pvolume->first_data_sector + (cluster - 2) * pvolume->super_sector.sectors_per_cluster;
+            if(disk_read(pvolume->disk, (int32_t)sector, buffer + i * cluster_size, pvolume->super_sector.sectors_per_cluster) != pvolume->super_sector.sectors_per_cluster){
+                free(buffer);
+                errno = EIO;
+                return -1;
+            }
+            cluster = *(uint16_t*)(pvolume->fat_table + cluster * 2);
+        }
+        count = clusters * cluster_size / sizeof(struct fat_entry_t);
+    }
+    *pentries = (struct fat_entry_t*)buffer;
+    *pcount = count;
+    return 0;
+}
+
+struct walk_state_t {
+    struct volume_t *volume;
+    dir_walk_fn fn;
+    void *ctx;
+    uint32_t next_id;
+    uint8_t *visited;       // one bit per cluster, guards against directory loops
+    char path[DIR_PATH_MAX];
+};
+
+// Steps through a loaded directory, assembling LFN runs on the way. Returns the next
+// real entry (no deleted or LFN slots, volume labels or dot links), NULL at the end.
+static struct fat_entry_t* dir_next_entry(struct fat_entry_t* entries, uint32_t count, uint32_t* pos,
+        struct lfn_state_t* lfn, char* long_name, int* has_long_name){
+    while(*pos < count){
+        struct fat_entry_t* entry = entries + (*pos)++;
+        if(entry->name[0] == 0x00){
+            *pos = count;
+            return NULL;
+        }
+        if(entry->name[0] == 0xE5){
+            lfn_reset(lfn);
+            continue;
+        }
+        if(entry->attr == FAT_ATTR_LFN){
+            lfn_feed(lfn, (const struct fat_lfn_entry_t*)entry);
+            continue;
+        }
+        *has_long_name = lfn_finish(lfn, entry, long_name);
+        if(entry->attr & FAT_ATTR_VOLUME || entry->name[0] == '.'){
+            continue;
+        }
+        return entry;
+    }
+    return NULL;
+}
+
+// Walks one loaded directory. A subdirectory is loaded before its own entry is
+// reported, so the callback sees in pwalk->error why its contents are missing;
+// the walk then carries on with the next entry instead of giving up.
+static int walk_dir(struct walk_state_t* st, struct fat_entry_t* entries, uint32_t count, size_t path_len, uint32_t parent, uint32_t depth){
+    struct lfn_state_t lfn;
+    char long_name[FAT_LONG_NAME_MAX];
+    lfn_reset(&lfn);
+    int has_long_name = 0;
+    uint32_t pos = 0;
+    int res = 0;
+    struct fat_entry_t* entry;
+    while((entry = dir_next_entry(entries, count, &pos, &lfn, long_name, &has_long_name)) != NULL){
+        char name[13];
+        fat_entry_name(entry, name);
+        const char *component = has_long_name ? long_name : name;
+        // DIR_PATH_MAX covers DIR_WALK_MAX_DEPTH components of the longest name
+        size_t name_len = strlen(component);
+        st->path[path_len] = '\\';
+        memcpy(st->path + path_len + 1, component, name_len + 1);
+
+        struct fat_entry_t *children = NULL;
+        uint32_t child_count = 0;
+        int error = 0;
+        if(entry->attr & FAT_ATTR_DIRECTORY){
+            uint16_t cluster = entry->first_cluster_y;
+            if(cluster < 2 || (uint32_t)(cluster - 2) >= st->volume->total_clusters){
+                error = EINVAL;
+            }
+            else if(st->visited[cluster / 8] & (1 << (cluster % 8)) || depth + 1 >= DIR_WALK_MAX_DEPTH){
+                error = ELOOP;
+            }
+            else{
+                st->visited[cluster / 8] |= 1 << (cluster % 8);
+                if(load_dir_entries(st->volume, cluster, &children, &child_count) != 0){
+                    if(errno == ENOMEM){
+                        res = -1;
+                        break;
+                    }
+                    error = errno;
+                }
+            }
+        }
+
+        struct walk_entry_t walk = {entry, name, has_long_name ? long_name : NULL, st->path, st->next_id++, parent, depth, error};
+        res = st->fn(&walk, st->ctx);
+        if(res == 0 && children != NULL){
+            res = walk_dir(st, children, child_count, path_len + 1 + name_len, walk.id, depth + 1);
+        }
+        free(children);
+        if(res != 0){
+            break;
+        }
+    }
+    st->path[path_len] = '\0';
+    return res;
+}
+
+int dir_walk(struct volume_t* pvolume, dir_walk_fn fn, void* ctx){
+    if(pvolume == NULL || fn == NULL){
+        errno = EFAULT;
+        return -1;
+    }
+    struct fat_entry_t *entries;
+    uint32_t count;
+    if(load_dir_entries(pvolume, 0, &entries, &count) != 0){
+        return -1;
+    }
+    struct walk_state_t* st = malloc(sizeof(struct walk_state_t));
+    if(st == NULL){
+        free(entries);
+        errno = ENOMEM;
+        return -1;
+    }
+    st->visited = calloc((pvolume->total_clusters + 2) / 8 + 1, 1);
+    if(st->visited == NULL){
+        free(st);
+        free(entries);
+        errno = ENOMEM;
+        return -1;
+    }
+    st->volume = pvolume;
+    st->fn = fn;
+    st->ctx = ctx;
+    st->next_id = 0;
+    st->path[0] = '\0';
+    int res = walk_dir(st, entries, count, 0, DIR_ROOT_PARENT, 0);
+    free(st->visited);
+    free(st);
+    free(entries);
+    return res;
+}
+
+uint32_t fat_decode_date(uint16_t date){
+    if(date == 0){
+        return 0;
+    }
+    uint32_t year = 1980 + (date >> 9);
+    uint32_t month = (date >> 5) & 0x0F;
+    uint32_t day = date & 0x1F;
+    return year * 10000 + month * 100 + day;
+}
+
+static int dir_table_grow(struct dir_table_t* ptable){
+    uint32_t capacity = ptable->capacity ? ptable->capacity * 2 : 256;
+    void *p;
+
+    if((p = realloc(ptable->names, capacity * sizeof(*ptable->names))) == NULL) return -1;
+    ptable->names = p;
+    if((p = realloc(ptable->long_name_offsets, capacity * sizeof(uint32_t))) == NULL) return -1;
+    ptable->long_name_offsets = p;
+    if((p = realloc(ptable->parents, capacity * sizeof(uint32_t))) == NULL) return -1;
+    ptable->parents = p;
+    if((p = realloc(ptable->sizes, capacity * sizeof(uint32_t))) == NULL) return -1;
+    ptable->sizes = p;
+    if((p = realloc(ptable->attrs, capacity * sizeof(uint8_t))) == NULL) return -1;
+    ptable->attrs = p;
+    if((p = realloc(ptable->create_dates, capacity * sizeof(uint32_t))) == NULL) return -1;
+    ptable->create_dates = p;
+    if((p = realloc(ptable->modify_dates, capacity * sizeof(uint32_t))) == NULL) return -1;
+    ptable->modify_dates = p;
+    if((p = realloc(ptable->access_dates, capacity * sizeof(uint32_t))) == NULL) return -1;
+    ptable->access_dates = p;
+    if((p = realloc(ptable->first_clusters, capacity * sizeof(uint16_t))) == NULL) return -1;
+    ptable->first_clusters = p;
+    if((p = realloc(ptable->errors, capacity * sizeof(int))) == NULL) return -1;
+    ptable->errors = p;
+    ptable->capacity = capacity;
+    return 0;
+}
+
+static int dir_table_append(const struct walk_entry_t* pwalk, void* ctx){
+    struct dir_table_t* ptable = ctx;
+    if(ptable->count == ptable->capacity && dir_table_grow(ptable) != 0){
+        errno = ENOMEM;
+        return -1;
+    }
+    uint32_t row = ptable->count;
+    strcpy(ptable->names[row], pwalk->name);
+    ptable->long_name_offsets[row] = DIR_NO_LONG_NAME;
+    if(pwalk->long_name != NULL){
+        uint32_t len = strlen(pwalk->long_name) + 1;
+        while(ptable->long_names_size + len > ptable->long_names_capacity){
+            uint32_t capacity = ptable->long_names_capacity ? ptable->long_names_capacity * 2 : 4096;
+            void *p = realloc(ptable->long_names, capacity);
+            if(p == NULL){
+                errno = ENOMEM;
+                return -1;
+            }
+            ptable->long_names = p;
+            ptable->long_names_capacity = capacity;
+        }
+        memcpy(ptable->long_names + ptable->long_names_size, pwalk->long_name, len);
+        ptable->long_name_offsets[row] = ptable->long_names_size;
+        ptable->long_names_size += len;
+    }
+    ptable->parents[row] = pwalk->parent;
+    ptable->sizes[row] = pwalk->entry->size;
+    ptable->attrs[row] = pwalk->entry->attr;
+    ptable->create_dates[row] = fat_decode_date(pwalk->entry->date);
+    ptable->modify_dates[row] = fat_decode_date(pwalk->entry->last_mod_date);
+    ptable->access_dates[row] = fat_decode_date(pwalk->entry->last_access_date);
+    ptable->first_clusters[row] = pwalk->entry->first_cluster_y;
+    ptable->errors[row] = pwalk->error;
+    if(pwalk->error != 0){
+        ptable->broken_dirs++;
+    }
+    ptable->count++;
+    return 0;
+}
+
+struct dir_table_t* dir_table_load(struct volume_t* pvolume){
+    if(pvolume == NULL){
+        errno = EFAULT;
+        return NULL;
+    }
+    struct dir_table_t* ptable = calloc(1, sizeof(struct dir_table_t));
+    if(ptable == NULL){
+        errno = ENOMEM;
+        return NULL;
+    }
+    if(dir_walk(pvolume, dir_table_append, ptable) != 0){
+        dir_table_close(ptable);
+        return NULL;
+    }
+    return ptable;
+}
+
+int dir_table_close(struct dir_table_t* ptable){
+    if(ptable != NULL){
+        free(ptable->names);
+        free(ptable->long_name_offsets);
+        free(ptable->long_names);
+        free(ptable->parents);
+        free(ptable->sizes);
+        free(ptable->attrs);
+        free(ptable->create_dates);
+        free(ptable->modify_dates);
+        free(ptable->access_dates);
+        free(ptable->first_clusters);
+        free(ptable->errors);
+        free(ptable);
+        return 0;
+    }
+    errno = EFAULT;
+    return -1;
+}
+
+void dir_query_init(struct dir_query_t* pquery){
+    if(pquery == NULL){
+        return;
+    }
+    pquery->size_min = 0;
+    pquery->size_max = UINT32_MAX;
+    pquery->date_field = DIR_DATE_MODIFY;
+    pquery->date_from = 0;
+    pquery->date_to = UINT32_MAX;
+    pquery->attr_mask = 0;
+    pquery->attr_value = 0;
+    pquery->name_glob = NULL;
+}
+
+static int glob_match(const char* pattern, const char* name){
+    const char *star = NULL;
+    const char *resume = NULL;
+
+    while(*name){
+        if(*pattern == '*'){
+            star = pattern++;
+            resume = name;
+        }
+        else if(*pattern == '?' || (*pattern && tolower((unsigned char)*pattern) == tolower((unsigned char)*name))){
+            pattern++;
+            name++;
+        }
+        else if(star != NULL){
+            pattern = star + 1;
+            name = ++resume;
+        }
+        else{
+            return 0;
+        }
+    }
+    while(*pattern == '*'){
+        pattern++;
+    }
+    return *pattern == '\0';
+}
+
+// Each filter is a separate pass over one column that compacts the selection
+// vector in place; the stores are unconditional so the loops stay branch-free.
+size_t dir_table_query(const struct dir_table_t* ptable, const struct dir_query_t* pquery, uint32_t* rows){
+    if(ptable == NULL || pquery == NULL || rows == NULL){
+        errno = EFAULT;
+        return -1;
+    }
+    size_t n = 0;
+    const uint32_t *sizes = ptable->sizes;
+    const uint8_t *attrs = ptable->attrs;
+    uint32_t size_min = pquery->size_min;
+    uint32_t size_max = pquery->size_max;
+    uint8_t attr_mask = pquery->attr_mask;
+    uint8_t attr_value = pquery->attr_value;
+    for(uint32_t i = 0; i < ptable->count; i++){
+        rows[n] = i;
+        n += (sizes[i] >= size_min) & (sizes[i] <= size_max) & ((attrs[i] & attr_mask) == attr_value);
+    }
+
+    if(pquery->date_from != 0 || pquery->date_to != UINT32_MAX){
+        const uint32_t *dates;
+        if(pquery->date_field == DIR_DATE_CREATE){
+            dates = ptable->create_dates;
+        }
+        else if(pquery->date_field == DIR_DATE_ACCESS){
+            dates = ptable->access_dates;
+        }
+        else{
+            dates = ptable->modify_dates;
+        }
+        size_t m = 0;
+        for(size_t k = 0; k < n; k++){
+            uint32_t row = rows[k];
+            rows[m] = row;
+            m += (dates[row] >= pquery->date_from) & (dates[row] <= pquery->date_to);
+        }
+        n = m;
+    }
+
+    if(pquery->name_glob != NULL){
+        size_t m = 0;
+        for(size_t k = 0; k < n; k++){
+            uint32_t row = rows[k];
+            uint32_t long_name = ptable->long_name_offsets[row];
+            rows[m] = row;
+            m += glob_match(pquery->name_glob, ptable->names[row]) |
+                    (long_name != DIR_NO_LONG_NAME && glob_match(pquery->name_glob, ptable->long_names + long_name));
+        }
+        n = m;
+    }
+    return n;
+}
+
+int dir_table_path(const struct dir_table_t* ptable, uint32_t row, char* buffer, size_t size){
+    if(ptable == NULL || buffer == NULL || size == 0){
+        errno = EFAULT;
+        return -1;
+    }
+    if(row >= ptable->count){
+        errno = ENOENT;
+        return -1;
+    }
+    // the path is assembled right to left, then moved to the start of the buffer
+    size_t pos = size - 1;
+    buffer[pos] = '\0';
+    uint32_t depth = 0;
+    while(row != DIR_ROOT_PARENT && depth++ <= DIR_WALK_MAX_DEPTH){
+        const char *name = ptable->names[row];
+        if(ptable->long_name_offsets[row] != DIR_NO_LONG_NAME){
+            name = ptable->long_names + ptable->long_name_offsets[row];
+        }
+        size_t len = strlen(name);
+        if(len + 1 > pos){
+            errno = ERANGE;
+            return -1;
+        }
+        pos -= len;
+        memcpy(buffer + pos, name, len);
+        buffer[--pos] = '\\';
+        row = ptable->parents[row];
+    }
+    memmove(buffer, buffer + pos, size - pos);
+    return 0;
+}
+
+// Seconds since the epoch for a FAT date/time pair, taken as UTC
+static int64_t fat_to_unix_time(uint16_t date, uint16_t time){
+    if(date == 0){
+        return 0;
+    }
+    int64_t y = 1980 + (date >> 9);
+    int64_t m = (date >> 5) & 0x0F;
+    int64_t d = date & 0x1F;
+    if(m < 1 || m > 12 || d < 1){
+        return 0;
+    }
+    // days_from_civil, shifted so the year starts in March
+    y -= m <= 2;
+    int64_t era = y / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    int64_t days = era * 146097 + doe - 719468;
+    return days * 86400 + (time >> 11) * 3600 + ((time >> 5) & 0x3F) * 60 + (time & 0x1F) * 2;
+}
+
+static int write_all(int fd, const void* buffer, size_t size){
+    const uint8_t *p = buffer;
+    while(size > 0){
+        ssize_t res = write(fd, p, size);
+        if(res < 0){
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        p += res;
+        size -= res;
+    }
+    return 0;
+}
+
+// Copies a byte range of one segment to fd. On Linux the kernel moves the data
+// with sendfile; elsewhere, or when fd does not support it, it goes through a small buffer.
+static int copy_segment_range(struct disk_segment_t* seg, uint64_t offset, uint64_t size, int fd){
+#ifdef __linux__
+    while(size > 0){
+        off_t pos = (off_t)offset;
+        ssize_t res = sendfile(fd, seg->fd, &pos, size > 0x40000000 ? 0x40000000 : size);
+        if(res < 0){
+            if(errno == EINTR) continue;
+            if(errno == EINVAL || errno == ENOSYS) break;
+            return -1;
+        }
+        if(res == 0){
+            errno = EIO;
+            return -1;
+        }
+        offset += res;
+        size -= res;
+    }
+#endif
+    uint8_t buffer[16 * SECTOR_SIZE];
+    while(size > 0){
+        size_t chunk = size > sizeof(buffer) ? sizeof(buffer) : size;
+        if(segment_read(seg, offset, buffer, chunk) != 0 || write_all(fd, buffer, chunk) != 0){
+            return -1;
+        }
+        offset += chunk;
+        size -= chunk;
+    }
+    return 0;
+}
+
+static int copy_image_range(struct disk_t* pdisk, uint64_t offset, uint64_t size, int fd){
+    while(size > 0){
+        struct disk_segment_t* seg = disk_find_segment(pdisk, offset);
+        if(seg == NULL){
+            errno = ERANGE;
+            return -1;
+        }
+        uint64_t chunk = seg->start + seg->size - offset;
+        if(chunk > size){
+            chunk = size;
+        }
+        if(copy_segment_range(seg, offset - seg->start, chunk, fd) != 0){
+            return -1;
+        }
+        offset += chunk;
+        size -= chunk;
+    }
+    return 0;
+}
+
+struct tar_header_t {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char __pad[12];
+};
+
+static void tar_octal(char* field, size_t size, uint64_t value){
+    field[size - 1] = '\0';
+    for(size_t i = size - 1; i > 0; i--){
+        field[i - 1] = (char)('0' + (value & 7));
+        value >>= 3;
+    }
+}
+
+static int tar_write_header(int fd, const char* name, char typeflag, uint32_t mode, uint64_t size, int64_t mtime){
+    struct tar_header_t header;
+    memset(&header, 0, sizeof(header));
+
+    size_t len = strlen(name);
+    if(len <= sizeof(header.name)){
+        memcpy(header.name, name, len);
+    }
+    else{
+        // name goes into prefix + "/" + name, split at a slash other than a directory's trailing one
+        size_t split = len - 2;
+        while(split > 0 && (name[split] != '/' || len - split - 1 > sizeof(header.name) || split > sizeof(header.prefix))){
+            split--;
+        }
+        if(split == 0){
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(header.prefix, name, split);
+        memcpy(header.name, name + split + 1, len - split - 1);
+    }
+    tar_octal(header.mode, sizeof(header.mode), mode);
+    tar_octal(header.uid, sizeof(header.uid), 0);
+    tar_octal(header.gid, sizeof(header.gid), 0);
+    tar_octal(header.size, sizeof(header.size), size);
+    tar_octal(header.mtime, sizeof(header.mtime), mtime > 0 ? (uint64_t)mtime : 0);
+    header.typeflag = typeflag;
+    memcpy(header.magic, "ustar", 6);
+    memcpy(header.version, "00", 2);
+
+    memset(header.chksum, ' ', sizeof(header.chksum));
+    uint32_t sum = 0;
+    for(size_t i = 0; i < sizeof(header); i++){
+        sum += ((uint8_t*)&header)[i];
+    }
+    tar_octal(header.chksum, 7, sum);
+    return write_all(fd, &header, sizeof(header));
+}
+
+static int tar_write_padding(int fd, uint64_t size){
+    static const uint8_t zeros[SECTOR_SIZE];
+    uint32_t tail = size % SECTOR_SIZE;
+    if(tail == 0){
+        return 0;
+    }
+    return write_all(fd, zeros, SECTOR_SIZE - tail);
+}
+
+// Paths longer than ustar can hold go into a pax extended header ("x")
+static int tar_write_pax_path(int fd, const char* path){
+    size_t len = strlen(path);
+    // record is "<length> path=<path>\n" where length counts its own digits
+    size_t base = len + 7;
+    size_t record = base;
+    size_t previous;
+    do{
+        previous = record;
+        record = base + snprintf(NULL, 0, "%zu", record);
+    }while(record != previous);
+    char prefix[24];
+    int prefix_len = snprintf(prefix, sizeof(prefix), "%zu path=", record);
+    if(tar_write_header(fd, "././@PaxHeader", 'x', 0644, record, 0) != 0 ||
+            write_all(fd, prefix, prefix_len) != 0 ||
+            write_all(fd, path, len) != 0 ||
+            write_all(fd, "\n", 1) != 0){
+        return -1;
+    }
+    return tar_write_padding(fd, record);
+}
+
+// Cuts s to at most max bytes without splitting a UTF-8 sequence.
+static size_t tar_utf8_cut(const char* s, size_t len, size_t max){
+    if(len <= max){
+        return len;
+    }
+    while(max > 0 && ((uint8_t)s[max] & 0xC0) == 0x80){
+        max--;
+    }
+    return max;
+}
+
+// Name for the ustar header that follows a pax path, for readers that ignore pax:
+// the directory cut to the 155 byte prefix and the last component cut to the 100 byte
+// name field, as GNU tar and libarchive do. out must hold 257 bytes.
+static void tar_short_name(const char* path, char* out){
+    size_t len = strlen(path);
+    int trailing = path[len - 1] == '/';
+    size_t slash = len - 1 - trailing;
+    while(slash > 0 && path[slash] != '/'){
+        slash--;
+    }
+    const char* base = path;
+    size_t out_len = 0;
+    if(path[slash] == '/'){
+        out_len = tar_utf8_cut(path, slash, 155);
+        while(out_len > 0 && path[out_len - 1] == '/'){
+            out_len--;
+        }
+        memcpy(out, path, out_len);
+        if(out_len > 0){
+            out[out_len++] = '/';
+        }
+        base = path + slash + 1;
+    }
+    size_t base_len = tar_utf8_cut(base, len - (size_t)(base - path) - trailing, 100 - trailing);
+    memcpy(out + out_len, base, base_len);
+    out_len += base_len;
+    if(trailing){
+        out[out_len++] = '/';
+    }
+    out[out_len] = '\0';
+}
+
+struct tar_state_t {
+    struct volume_t *volume;
+    int fd;
+    uint32_t damaged;       // entries written with zero-filled gaps, missing contents or a replaced name
+    size_t prefix[DIR_WALK_MAX_DEPTH + 1];  // length of the member name of the directory open at each depth
+    char name[DIR_PATH_MAX + 1];
+};
+
+static int tar_write_zeros(int fd, uint64_t size){
+    static const uint8_t zeros[16 * SECTOR_SIZE];
+    while(size > 0){
+        size_t chunk = size > sizeof(zeros) ? sizeof(zeros) : size;
+        if(write_all(fd, zeros, chunk) != 0){
+            return -1;
+        }
+        size -= chunk;
+    }
+    return 0;
+}
+
+static int tar_write_payload(struct tar_state_t* st, const struct fat_entry_t* entry){
+    struct volume_t *pvolume = st->volume;
+    uint32_t cluster_size = pvolume->super_sector.sectors_per_cluster * SECTOR_SIZE;
+    uint64_t remaining = entry->size;
+    uint16_t cluster = entry->first_cluster_y;
+
+    // follows the FAT in place and hands each run of adjacent clusters over at once.
+    // The header already promised entry->size bytes, so when the chain breaks early
+    // the rest is zero-filled to keep the stream readable and the entry counted as damaged.
+    while(remaining > 0){
+        if(cluster < 2 || cluster >= FAT16_BAD_CLUSTER || (uint32_t)(cluster - 2) >= pvolume->total_clusters ||
+                (uint32_t)cluster * 2 + 2 > pvolume->fat_size){
+            st->damaged++;
+            if(tar_write_zeros(st->fd, remaining) != 0){
+                return -1;
+            }
+            break;
+        }
+        uint16_t first = cluster;
+        uint64_t count = 1;
+        uint16_t next = *(uint16_t*)(pvolume->fat_table + cluster * 2);
+        while(count * cluster_size < remaining && next == cluster + 1 &&
+                (uint32_t)(next - 2) < pvolume->total_clusters && (uint32_t)next * 2 + 2 <= pvolume->fat_size){
+            cluster = next;
+            next = *(uint16_t*)(pvolume->fat_table + cluster * 2);
+            count++;
+        }
+        uint64_t run = count * cluster_size;
+        if(run > remaining){
+            run = remaining;
+        }
+        uint64_t offset = ((uint64_t)pvolume->first_data_sector + (uint64_t)(first - 2) * pvolume->super_sector.sectors_per_cluster) * SECTOR_SIZE;
+        if(copy_image_range(pvolume->disk, offset, run, st->fd) != 0){
+            return -1;
+        }
+        remaining -= run;
+        cluster = next;
+    }
+    return tar_write_padding(st->fd, entry->size);
+}
+
+static int tar_name_safe(const char* name){
+    return name[0] != '\0' && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 && strpbrk(name, "/\\") == NULL;
+}
+
+static int tar_append(const struct walk_entry_t* pwalk, void* ctx){
+    struct tar_state_t* st = ctx;
+    const struct fat_entry_t* entry = pwalk->entry;
+    int is_directory = (entry->attr & FAT_ATTR_DIRECTORY) != 0;
+    if(pwalk->error != 0){
+        st->damaged++;
+    }
+
+    // member names are rebuilt from the names of the walk rather than its path so that
+    // no component can climb out of the extraction directory: a name that is "." or ".."
+    // or carries a separator falls back to the 8.3 name, and one that still does not fit
+    // has the offending characters replaced. Directories get a trailing slash.
+    const char* component = pwalk->long_name;
+    if(component != NULL && !tar_name_safe(component)){
+        component = NULL;
+    }
+    if(component == NULL){
+        component = pwalk->name;
+    }
+    int renamed = component != pwalk->long_name && pwalk->long_name != NULL;
+    int dots = strcmp(component, ".") == 0 || strcmp(component, "..") == 0;
+    size_t len = st->prefix[pwalk->depth];
+    for(const char* p = component; *p; p++){
+        if(dots || *p == '/' || *p == '\\'){
+            st->name[len++] = '_';
+            renamed = 1;
+        }
+        else{
+            st->name[len++] = *p;
+        }
+    }
+    if(renamed){
+        st->damaged++;
+    }
+    if(is_directory){
+        st->name[len++] = '/';
+        if(pwalk->depth < DIR_WALK_MAX_DEPTH){
+            st->prefix[pwalk->depth + 1] = len;
+        }
+    }
+    st->name[len] = '\0';
+
+    uint32_t mode = is_directory ? 0755 : (entry->attr & FAT_ATTR_READONLY ? 0444 : 0644);
+    uint64_t size = is_directory ? 0 : entry->size;
+    int64_t mtime = fat_to_unix_time(entry->last_mod_date, entry->last_mod_time);
+    char typeflag = is_directory ? '5' : '0';
+    int res = tar_write_header(st->fd, st->name, typeflag, mode, size, mtime);
+    if(res != 0 && errno == ENAMETOOLONG){
+        char short_name[257];
+        tar_short_name(st->name, short_name);
+        res = tar_write_pax_path(st->fd, st->name);
+        if(res == 0){
+            res = tar_write_header(st->fd, short_name, typeflag, mode, size, mtime);
+        }
+    }
+    if(res != 0){
+        return -1;
+    }
+    if(is_directory || size == 0){
+        return 0;
+    }
+    return tar_write_payload(st, entry);
+}
+
+int volume_export_tar(struct volume_t* pvolume, int fd){
+    if(pvolume == NULL || fd < 0){
+        errno = EFAULT;
+        return -1;
+    }
+    struct tar_state_t* st = malloc(sizeof(struct tar_state_t));
+    if(st == NULL){
+        errno = ENOMEM;
+        return -1;
+    }
+    st->volume = pvolume;
+    st->fd = fd;
+    st->damaged = 0;
+    st->prefix[0] = 0;
+    int res = dir_walk(pvolume, tar_append, st);
+    uint32_t damaged = st->damaged;
+    free(st);
+    // end of archive: two zero blocks, written after a failed walk too so that
+    // a reader sees the end of what was written as long as fd still takes data
+    int walk_errno = errno;
+    int end = tar_write_zeros(fd, 2 * SECTOR_SIZE);
+    if(res != 0){
+        errno = walk_errno;
+        return -1;
+    }
+    if(end != 0){
+        return -1;
+    }
+    return (int)damaged;
+}
+
+struct cluster_map_t* cluster_map_build(struct volume_t* pvolume){
+    if(pvolume == NULL){
+        errno = EFAULT;
+        return NULL;
+    }
+    struct cluster_map_t* pmap = calloc(1, sizeof(struct cluster_map_t));
+    if(pmap == NULL){
+        errno = ENOMEM;
+        return NULL;
+    }
+    pmap->volume = pvolume;
+    pmap->table = dir_table_load(pvolume);
+    if(pmap->table == NULL){
+        cluster_map_close(pmap);
+        return NULL;
+    }
+    // clusters 0 and 1 are reserved, so the arrays are indexed by cluster number directly
+    uint32_t fat_entries = pvolume->fat_size / 2;
+    pmap->cluster_count = pvolume->total_clusters + 2;
+    if(pmap->cluster_count > fat_entries){
+        pmap->cluster_count = fat_entries;
+    }
+    pmap->owners = malloc(pmap->cluster_count * sizeof(uint32_t));
+    pmap->positions = malloc(pmap->cluster_count * sizeof(uint16_t));
+    if(pmap->owners == NULL || pmap->positions == NULL){
+        cluster_map_close(pmap);
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(pmap->owners, 0xFF, pmap->cluster_count * sizeof(uint32_t));
+
+    // every chain is followed until it ends or reaches a cluster that is already
+    // owned, which also stops loops and cross-linked chains: each cluster is visited once
+    const uint16_t *fat = (const uint16_t*)pvolume->fat_table;
+    for(uint32_t row = 0; row < pmap->table->count; row++){
+        uint16_t cluster = pmap->table->first_clusters[row];
+        uint16_t position = 0;
+        while(cluster >= 2 && cluster < pmap->cluster_count && pmap->owners[cluster] == CLUSTER_NO_OWNER){
+            pmap->owners[cluster] = row;
+            pmap->positions[cluster] = position++;
+            cluster = fat[cluster];
+        }
+    }
+    return pmap;
+}
+
+int cluster_map_close(struct cluster_map_t* pmap){
+    if(pmap != NULL){
+        if(pmap->table != NULL){
+            dir_table_close(pmap->table);
+        }
+        free(pmap->owners);
+        free(pmap->positions);
+        free(pmap);
+        return 0;
+    }
+    errno = EFAULT;
+    return -1;
+}
+
+int cluster_map_lookup(const struct cluster_map_t* pmap, uint16_t cluster, struct cluster_owner_t* powner){
+    if(pmap == NULL || powner == NULL){
+        errno = EFAULT;
+        return -1;
+    }
+    if(cluster < 2 || cluster >= pmap->cluster_count){
+        errno = ERANGE;
+        return -1;
+    }
+    powner->region = CLUSTER_REGION_DATA;
+    powner->cluster = cluster;
+    powner->row = pmap->owners[cluster];
+    powner->file_offset = 0;
+    if(powner->row != CLUSTER_NO_OWNER){
+        powner->file_offset = (uint32_t)pmap->positions[cluster] * pmap->volume->super_sector.sectors_per_cluster * SECTOR_SIZE;
+    }
+    return 0;
+}
+
+int cluster_map_lookup_offset(const struct cluster_map_t* pmap, uint64_t image_offset, struct cluster_owner_t* powner){
+    if(pmap == NULL || powner == NULL){
+        errno = EFAULT;
+        return -1;
+    }
+    struct volume_t *pvolume = pmap->volume;
+    uint64_t sector = image_offset / SECTOR_SIZE;
+    uint32_t fat_start = pvolume->first_sector + pvolume->super_sector.reserved_sectors;
+    uint32_t root_start = fat_start + pvolume->super_sector.fat_count * pvolume->super_sector.sectors_per_fat;
+    if(sector < pvolume->first_sector || sector >= (uint64_t)pvolume->first_sector + pvolume->total_sectors){
+        errno = ERANGE;
+        return -1;
+    }
+
+    powner->row = CLUSTER_NO_OWNER;
+    powner->cluster = 0;
+    powner->file_offset = 0;
+    if(sector < fat_start){
+        powner->region = CLUSTER_REGION_RESERVED;
+        return 0;
+    }
+    if(sector < root_start){
+        powner->region = CLUSTER_REGION_FAT;
+        return 0;
+    }
+    if(sector < pvolume->first_data_sector){
+        powner->region = CLUSTER_REGION_ROOT_DIR;
+        return 0;
+    }
+
+    uint32_t cluster_size = pvolume->super_sector.sectors_per_cluster * SECTOR_SIZE;
+    uint64_t data_offset = image_offset - (uint64_t)pvolume->first_data_sector * SECTOR_SIZE;
+    uint64_t cluster = data_offset / cluster_size + 2;
+    if(cluster >= pmap->cluster_count){
+        // sectors past the last whole cluster
+        powner->region = CLUSTER_REGION_DATA;
+        return 0;
+    }
+    cluster_map_lookup(pmap, (uint16_t)cluster, powner);
+    if(powner->row != CLUSTER_NO_OWNER){
+        powner->file_offset += data_offset % cluster_size;
+    }
+    return 0;
+}
 
 struct clusters_chain_t *get_chain_fat16(const void * const buffer, size_t size, uint16_t first_cluster){
     if(buffer == NULL || first_cluster < 2 || size%2 != 0 || size < 4 ){
@@ -456,11 +1906,8 @@ struct clusters_chain_t *get_chain_fat16(const void * const buffer, size_t size,
     }
 
     uint16_t current = *(uint16_t*)((uint8_t*)buffer + offset);
-    uint16_t count = 1;
+    uint32_t count = 1;
     while(1){
-        if(offset + 2 > size){
-            return NULL;
-        }
         if(current == FAT16_BAD_CLUSTER || current == FAT16_FREE_CLUSTER || current == 0x0001){
             return NULL;
         }
@@ -468,6 +1915,10 @@ struct clusters_chain_t *get_chain_fat16(const void * const buffer, size_t size,
             break;
         }
         offset = current * 2;
+        // a chain longer than the FAT has entries must contain a loop
+        if(offset + 2 > size || count >= size / 2){
+            return NULL;
+        }
         current = *(uint16_t*)((uint8_t*)buffer + offset);
         count++;
     }
@@ -482,7 +1933,7 @@ struct clusters_chain_t *get_chain_fat16(const void * const buffer, size_t size,
     }
     cluster_chain->size = count;
     uint16_t curr = first_cluster;
-    for (uint16_t i = 0; i < count; ++i) {
+    for (uint32_t i = 0; i < count; ++i) {
         *(cluster_chain->clusters + i) = curr;
         if(i < count - 1){
             offset = curr * 2;
@@ -13,6 +13,20 @@
 #define FAT16_BAD_CLUSTER 0xFFF7
 #define FAT16_FREE_CLUSTER 0x0000
 
+#define FAT_ATTR_READONLY 0x01
+#define FAT_ATTR_HIDDEN 0x02
+#define FAT_ATTR_SYSTEM 0x04
+#define FAT_ATTR_VOLUME 0x08
+#define FAT_ATTR_DIRECTORY 0x10
+#define FAT_ATTR_ARCHIVE 0x20
+#define FAT_ATTR_LFN 0x0F
+
+// 255 UTF-16 code units, at most 3 UTF-8 bytes each, plus the terminator
+#define FAT_LONG_NAME_MAX 766
+// longest walk path: DIR_WALK_MAX_DEPTH components, each a separator plus a long name
+#define DIR_PATH_MAX (DIR_WALK_MAX_DEPTH * FAT_LONG_NAME_MAX + 1)
+#define DIR_WALK_MAX_DEPTH 32
+
 struct fat_super_t {
     uint8_t __jump_code[3];
     char oem_name[8];
@@ -60,8 +74,21 @@ struct fat_entry_t{
     uint32_t size;          //28-31
 }__attribute__((packed));
 
+// VFAT long name slot, stored in reverse order right before its 8.3 entry
+struct fat_lfn_entry_t{
+    uint8_t order;          //0     sequence number, 0x40 marks the last slot
+    uint16_t name1[5];      //1-10
+    uint8_t attr;           //11    always 0x0F
+    uint8_t type;           //12
+    uint8_t checksum;       //13    checksum of the 8.3 name
+    uint16_t name2[6];      //14-25
+    uint16_t first_cluster; //26-27 always 0
+    uint16_t name3[2];      //28-31
+}__attribute__((packed));
+
 struct dir_entry_t{
     char name[13];
+    char long_name[FAT_LONG_NAME_MAX];  // empty when the entry has no valid LFN
     uint32_t size;
     uint8_t is_archived;
     uint8_t is_readonly;
@@ -75,11 +102,27 @@ struct clusters_chain_t {
     size_t size;
 };
 
+#define DISK_MAX_SEGMENTS 999
+
+// One file of the image. The extent fields cache the last data/hole range
+// found with SEEK_DATA/SEEK_HOLE, relative to the segment.
+struct disk_segment_t {
+    int fd;
+    uint64_t start;         // offset of the segment in the combined image
+    uint64_t size;
+    uint64_t extent_start;
+    uint64_t extent_end;
+    uint8_t extent_is_hole;
+};
+
 struct disk_t {
-    FILE *file;
-    size_t size;
+    struct disk_segment_t *segments;    // sorted by start
+    uint32_t segment_count;
+    uint64_t size;
 };
+// A name ending in .001 opens the split image .001, .002, ... as one disk
 struct disk_t* disk_open_from_file(const char* volume_file_name);
+struct disk_t* disk_open_from_segments(const char* const* segment_names, uint32_t segment_count);
 int disk_read(struct disk_t* pdisk, int32_t first_sector, void* buffer, int32_t sectors_to_read);
 int disk_close(struct disk_t* pdisk);
 
@@ -94,6 +137,7 @@ struct volume_t {
     uint32_t total_sectors;
     uint32_t data_sectors;
     uint32_t total_clusters;
+    struct name_index_t *name_index;    // filled by file_open, one directory at a time
 };
 struct volume_t* fat_open(struct disk_t* pdisk, uint32_t first_sector);
 int fat_close(struct volume_t* pvolume);
@@ -104,20 +148,141 @@ struct file_t {
     uint32_t position;
     struct clusters_chain_t* chain;
 };
+// file_name may be a path (DOCS\My notes.txt, /DOCS/NOTES~1.TXT); each component
+// matches either the long or the 8.3 name, ignoring ASCII case.
 struct file_t* file_open(struct volume_t* pvolume, const char* file_name);
 int file_close(struct file_t* stream);
 size_t file_read(void *ptr, size_t size, size_t nmemb, struct file_t *stream);
 int32_t file_seek(struct file_t* stream, int32_t offset, int whence);
 
+struct lfn_state_t {
+    uint16_t units[260];
+    uint8_t checksum;
+    uint8_t slots;
+    uint8_t next;
+    uint8_t valid;
+};
+
 struct dir_t {
     struct volume_t *volume;
     uint32_t current_sector;
     uint32_t current_entry;
     uint32_t max_entries;
+    uint8_t sector_buffer[SECTOR_SIZE];
+    struct lfn_state_t lfn;
 };
 struct dir_t* dir_open(struct volume_t* pvolume, const char* dir_path);
 int dir_read(struct dir_t* pdir, struct dir_entry_t* pentry);
 int dir_close(struct dir_t* pdir);
 
+// Recursive pre-order walk over every entry of the volume, root directory first.
+// Entries get sequential ids; parent is the id of the containing directory
+// or DIR_ROOT_PARENT. A non-zero return from the callback stops the walk.
+// Only an unreadable root directory or running out of memory fail the walk;
+// a damaged subdirectory is reported through error and skipped.
+#define DIR_ROOT_PARENT UINT32_MAX
+struct walk_entry_t {
+    const struct fat_entry_t *entry;
+    const char *name;       // 8.3 name
+    const char *long_name;  // VFAT name or NULL
+    const char *path;       // full path built from long names where present
+    uint32_t id;
+    uint32_t parent;
+    uint32_t depth;
+    int error;              // directories only: 0, or why their contents were not walked (EINVAL, EIO, ELOOP)
+};
+typedef int (*dir_walk_fn)(const struct walk_entry_t* pwalk, void* ctx);
+int dir_walk(struct volume_t* pvolume, dir_walk_fn fn, void* ctx);
+
+// Column store of all entries of a volume, row i == walk id i.
+// Dates are decoded to YYYYMMDD, 0 when unset.
+struct dir_table_t {
+    uint32_t count;
+    uint32_t capacity;
+    char (*names)[13];
+    uint32_t *long_name_offsets;    // into long_names, DIR_NO_LONG_NAME when absent
+    char *long_names;
+    uint32_t long_names_size;
+    uint32_t long_names_capacity;
+    uint32_t *parents;
+    uint32_t *sizes;
+    uint8_t *attrs;
+    uint32_t *create_dates;
+    uint32_t *modify_dates;
+    uint32_t *access_dates;
+    uint16_t *first_clusters;
+    int *errors;                    // walk_entry_t.error of each row
+    uint32_t broken_dirs;           // rows with a non-zero error
+};
+
+#define DIR_NO_LONG_NAME UINT32_MAX
+
+enum dir_date_field {
+    DIR_DATE_CREATE,
+    DIR_DATE_MODIFY,
+    DIR_DATE_ACCESS
+};
+
+// All bounds inclusive; dir_query_init() sets every filter to match all.
+struct dir_query_t {
+    uint32_t size_min;
+    uint32_t size_max;
+    enum dir_date_field date_field;
+    uint32_t date_from;
+    uint32_t date_to;
+    uint8_t attr_mask;      // row matches when (attr & attr_mask) == attr_value
+    uint8_t attr_value;
+    const char *name_glob;  // '*' and '?', case-insensitive, long or 8.3 name, NULL = any
+};
+
+struct dir_table_t* dir_table_load(struct volume_t* pvolume);
+int dir_table_close(struct dir_table_t* ptable);
+void dir_query_init(struct dir_query_t* pquery);
+// Writes the matching row numbers to rows and returns how many matched. rows is
+// used as scratch for every candidate, so it must hold ptable->count entries
+// regardless of how many rows are expected to match.
+size_t dir_table_query(const struct dir_table_t* ptable, const struct dir_query_t* pquery, uint32_t* rows);
+int dir_table_path(const struct dir_table_t* ptable, uint32_t row, char* buffer, size_t size);
+uint32_t fat_decode_date(uint16_t date);
+
+// Streams every entry of the volume to fd as a ustar archive. Payloads are copied
+// straight from the image following the cluster chains; memory use does not grow with the volume.
+// Damage does not stop the export: a file whose chain breaks is zero-filled to its size
+// and an unreadable directory is written empty. A name that could escape the extraction
+// directory is stored under its 8.3 name or with the separators replaced. Returns how many
+// entries were damaged or renamed, or -1 when the archive could not be completed; the
+// end-of-archive blocks are still attempted then, so the errno reported is the first failure's.
+int volume_export_tar(struct volume_t* pvolume, int fd);
+
+// Reverse map from data clusters to the directory table row owning them,
+// built from one walk and one pass over each chain. Lookups are O(1).
+#define CLUSTER_NO_OWNER UINT32_MAX
+struct cluster_map_t {
+    struct volume_t *volume;
+    struct dir_table_t *table;
+    uint32_t cluster_count;     // arrays below are indexed by cluster number
+    uint32_t *owners;           // table row, CLUSTER_NO_OWNER for free or orphaned clusters
+    uint16_t *positions;        // index of the cluster within its owner's chain
+};
+
+enum cluster_region {
+    CLUSTER_REGION_RESERVED,
+    CLUSTER_REGION_FAT,
+    CLUSTER_REGION_ROOT_DIR,
+    CLUSTER_REGION_DATA
+};
+
+struct cluster_owner_t {
+    enum cluster_region region;
+    uint16_t cluster;           // 0 outside the data region
+    uint32_t row;               // row of map->table, CLUSTER_NO_OWNER when unowned
+    uint32_t file_offset;       // byte offset within the owner
+};
+
+struct cluster_map_t* cluster_map_build(struct volume_t* pvolume);
+int cluster_map_close(struct cluster_map_t* pmap);
+int cluster_map_lookup(const struct cluster_map_t* pmap, uint16_t cluster, struct cluster_owner_t* powner);
+int cluster_map_lookup_offset(const struct cluster_map_t* pmap, uint64_t image_offset, struct cluster_owner_t* powner);
+
 struct clusters_chain_t *get_chain_fat16(const void * const buffer, size_t size, uint16_t first_cluster);
 #endif //PROJEKTFAT_FILE_READER_H
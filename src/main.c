@@ -1,6 +1,9 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "file_reader.h"
 
 // MBR partition table entry structure
@@ -29,9 +32,175 @@ uint32_t find_fat16_partition(struct disk_t* disk) {
     return 0;  // Default fallback for raw filesystems
 }
 
+static void print_find_usage(const char* prog) {
+    printf("Usage: %s <fat16_image> find [-name GLOB] [-type f|d] [-attr rhsa]\n"
+           "       [-size-min N] [-size-max N] [-date create|modify|access]\n"
+           "       [-from YYYYMMDD] [-to YYYYMMDD]\n", prog);
+}
+
+// find mode: load every entry of the volume into a column table and filter it
+static int find_files(struct volume_t* volume, int argc, char* argv[]) {
+    struct dir_query_t query;
+    dir_query_init(&query);
+
+    for (int i = 3; i < argc; i++) {
+        if (i + 1 >= argc) {
+            print_find_usage(argv[0]);
+            return 1;
+        }
+        const char* opt = argv[i];
+        const char* val = argv[++i];
+        if (strcmp(opt, "-name") == 0) {
+            query.name_glob = val;
+        } else if (strcmp(opt, "-type") == 0) {
+            query.attr_mask |= FAT_ATTR_DIRECTORY;
+            if (val[0] == 'd') query.attr_value |= FAT_ATTR_DIRECTORY;
+            else query.attr_value &= ~FAT_ATTR_DIRECTORY;
+        } else if (strcmp(opt, "-attr") == 0) {
+            for (const char* c = val; *c; c++) {
+                uint8_t bit = 0;
+                if (*c == 'r') bit = FAT_ATTR_READONLY;
+                else if (*c == 'h') bit = FAT_ATTR_HIDDEN;
+                else if (*c == 's') bit = FAT_ATTR_SYSTEM;
+                else if (*c == 'a') bit = FAT_ATTR_ARCHIVE;
+                query.attr_mask |= bit;
+                query.attr_value |= bit;
+            }
+        } else if (strcmp(opt, "-size-min") == 0) {
+            query.size_min = (uint32_t)strtoul(val, NULL, 10);
+        } else if (strcmp(opt, "-size-max") == 0) {
+            query.size_max = (uint32_t)strtoul(val, NULL, 10);
+        } else if (strcmp(opt, "-date") == 0) {
+            if (strcmp(val, "create") == 0) query.date_field = DIR_DATE_CREATE;
+            else if (strcmp(val, "access") == 0) query.date_field = DIR_DATE_ACCESS;
+            else query.date_field = DIR_DATE_MODIFY;
+        } else if (strcmp(opt, "-from") == 0) {
+            query.date_from = (uint32_t)strtoul(val, NULL, 10);
+        } else if (strcmp(opt, "-to") == 0) {
+            query.date_to = (uint32_t)strtoul(val, NULL, 10);
+        } else {
+            print_find_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    struct dir_table_t* table = dir_table_load(volume);
+    if (!table) {
+        printf("Failed to load directory table\n");
+        return 1;
+    }
+    uint32_t* rows = malloc((table->count ? table->count : 1) * sizeof(uint32_t));
+    if (!rows) {
+        printf("Failed to allocate memory for query results\n");
+        dir_table_close(table);
+        return 1;
+    }
+
+    size_t found = dir_table_query(table, &query, rows);
+    char path[DIR_PATH_MAX];
+    for (size_t i = 0; i < found; i++) {
+        uint32_t row = rows[i];
+        if (dir_table_path(table, row, path, sizeof(path)) != 0) continue;
+        printf("%-40s %10u  %08u", path, table->sizes[row], table->modify_dates[row]);
+        if (table->attrs[row] & FAT_ATTR_DIRECTORY) printf(" [DIR]");
+        if (table->attrs[row] & FAT_ATTR_READONLY) printf(" [RO]");
+        if (table->attrs[row] & FAT_ATTR_HIDDEN) printf(" [HIDDEN]");
+        if (table->errors[row]) printf(" [UNREADABLE: %s]", strerror(table->errors[row]));
+        printf("\n");
+    }
+    printf("%zu of %u entries matched\n", found, table->count);
+    if (table->broken_dirs) {
+        printf("%u directories could not be read, their contents are missing\n", table->broken_dirs);
+    }
+
+    free(rows);
+    dir_table_close(table);
+    return 0;
+}
+
+// owner mode: report which entry holds given clusters or image byte offsets
+static int find_owners(struct volume_t* volume, int argc, char* argv[]) {
+    int by_offset = argc > 3 && strcmp(argv[3], "offset") == 0;
+    if (argc < 5 || (!by_offset && strcmp(argv[3], "cluster") != 0)) {
+        printf("Usage: %s <fat16_image> owner cluster|offset N [N...]\n", argv[0]);
+        return 1;
+    }
+
+    struct cluster_map_t* map = cluster_map_build(volume);
+    if (!map) {
+        printf("Failed to build cluster map\n");
+        return 1;
+    }
+
+    if (map->table->broken_dirs) {
+        printf("Warning: %u directories could not be read, their clusters show as unowned\n", map->table->broken_dirs);
+    }
+
+    static const char* regions[] = {"reserved sectors", "FAT", "root directory", "data"};
+    char path[DIR_PATH_MAX];
+    int res = 0;
+    for (int i = 4; i < argc; i++) {
+        unsigned long long value = strtoull(argv[i], NULL, 0);
+        struct cluster_owner_t owner;
+        int found = by_offset ? cluster_map_lookup_offset(map, value, &owner)
+                              : (value > UINT16_MAX ? -1 : cluster_map_lookup(map, (uint16_t)value, &owner));
+        printf("%s %s: ", by_offset ? "offset" : "cluster", argv[i]);
+        if (found != 0) {
+            printf("outside the volume\n");
+            res = 1;
+            continue;
+        }
+        if (owner.region != CLUSTER_REGION_DATA) {
+            printf("%s\n", regions[owner.region]);
+            continue;
+        }
+        if (owner.cluster == 0) {
+            printf("data area, past the last cluster\n");
+            continue;
+        }
+        if (owner.row == CLUSTER_NO_OWNER) {
+            printf("cluster %u, not owned by any entry\n", owner.cluster);
+            continue;
+        }
+        dir_table_path(map->table, owner.row, path, sizeof(path));
+        printf("cluster %u, %s at offset %u", owner.cluster, path, owner.file_offset);
+        if (owner.file_offset >= map->table->sizes[owner.row] && !(map->table->attrs[owner.row] & FAT_ATTR_DIRECTORY)) {
+            printf(" (slack)");
+        }
+        printf("\n");
+    }
+
+    cluster_map_close(map);
+    return res;
+}
+
+// export mode: stream the whole volume as a tar archive to a file or stdout;
+// messages go to stderr so they never mix with the archive
+static int export_tar(struct volume_t* volume, int argc, char* argv[]) {
+    int fd = STDOUT_FILENO;
+    if (argc > 3 && strcmp(argv[3], "-") != 0) {
+        fd = open(argv[3], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "Failed to create '%s'\n", argv[3]);
+            return 1;
+        }
+    }
+
+    int res = volume_export_tar(volume, fd);
+    if (res < 0) {
+        perror("Export failed");
+    } else if (res > 0) {
+        fprintf(stderr, "Warning: %d damaged entries were exported incomplete or renamed\n", res);
+    }
+    if (fd != STDOUT_FILENO) {
+        close(fd);
+    }
+    return res != 0;
+}
+
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        printf("Usage: %s <fat16_image>\n", argv[0]);
+    if (argc < 2) {
+        printf("Usage: %s <fat16_image> [find [options] | export [output.tar] | owner cluster|offset N...]\n", argv[0]);
         return 1;
     }
 
@@ -50,6 +219,22 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    if (argc > 2) {
+        int res = 1;
+        if (strcmp(argv[2], "find") == 0) {
+            res = find_files(volume, argc, argv);
+        } else if (strcmp(argv[2], "owner") == 0) {
+            res = find_owners(volume, argc, argv);
+        } else if (strcmp(argv[2], "export") == 0) {
+            res = export_tar(volume, argc, argv);
+        } else {
+            printf("Unknown mode '%s'\n", argv[2]);
+        }
+        fat_close(volume);
+        disk_close(disk);
+        return res;
+    }
+
     printf("FAT16 Reader Demo\n");
     printf("=================\n");
 
@@ -65,6 +250,7 @@ int main(int argc, char* argv[]) {
             if (entry.is_directory) printf(" [DIR]");
             if (entry.is_readonly) printf(" [RO]");
             if (entry.is_hidden) printf(" [HIDDEN]");
+            if (entry.long_name[0]) printf("  %s", entry.long_name);
             printf("\n");
 
             // Save first non-directory file for reading